@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMU_HAVE_SSE2
+#define IMU_HAVE_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define IMU_HAVE_NEON
+#endif
+
+/* Must be a multiple of the widest vector, so batches can always be processed in full vectors */
+#define IMU_BATCH_SIZE 64
+
+enum imu_channel {
+    IMU_GYRO_X,
+    IMU_GYRO_Y,
+    IMU_GYRO_Z,
+    IMU_ACCEL_X,
+    IMU_ACCEL_Y,
+    IMU_ACCEL_Z,
+    IMU_CHANNELS,
+};
+
+/* Physical value is (raw - bias) * scale, deg/s for gyro and g for accelerometer */
+struct imu_calibration {
+    float bias[IMU_CHANNELS];
+    float scale[IMU_CHANNELS];
+};
+
+/*
+ * Batch of motion samples in structure-of-arrays layout. Raw samples are
+ * gathered from input reports, imu_calibrate() fills in the values.
+ */
+struct imu_batch {
+    size_t count;
+    uint64_t timestamp[IMU_BATCH_SIZE]; /* CLOCK_MONOTONIC ns */
+    uint32_t sensor_timestamp[IMU_BATCH_SIZE];
+    _Alignas(32) int16_t raw[IMU_CHANNELS][IMU_BATCH_SIZE];
+    _Alignas(32) float value[IMU_CHANNELS][IMU_BATCH_SIZE];
+};
+
+static void imu_calibrate_scalar(const int16_t *raw, float *out, size_t len, float bias, float scale)
+{
+    for (size_t i = 0; i < len; ++i) {
+        out[i] = (raw[i] - bias) * scale;
+    }
+}
+
+#ifdef IMU_HAVE_SSE2
+__attribute__((target("sse2")))
+static void imu_calibrate_sse2(const int16_t *raw, float *out, size_t len, float bias, float scale)
+{
+    const __m128 b = _mm_set1_ps(bias);
+    const __m128 s = _mm_set1_ps(scale);
+    for (size_t i = 0; i < len; i += 8) {
+        __m128i x = _mm_load_si128((const __m128i *)&raw[i]);
+        /* Sign extend by unpacking into the upper halves and shifting back */
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_store_ps(&out[i], _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(lo), b), s));
+        _mm_store_ps(&out[i + 4], _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(hi), b), s));
+    }
+}
+#endif
+
+#ifdef IMU_HAVE_AVX2
+__attribute__((target("avx2")))
+static void imu_calibrate_avx2(const int16_t *raw, float *out, size_t len, float bias, float scale)
+{
+    const __m256 b = _mm256_set1_ps(bias);
+    const __m256 s = _mm256_set1_ps(scale);
+    for (size_t i = 0; i < len; i += 8) {
+        __m256i x = _mm256_cvtepi16_epi32(_mm_load_si128((const __m128i *)&raw[i]));
+        _mm256_store_ps(&out[i], _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(x), b), s));
+    }
+}
+#endif
+
+#ifdef IMU_HAVE_NEON
+static void imu_calibrate_neon(const int16_t *raw, float *out, size_t len, float bias, float scale)
+{
+    const float32x4_t b = vdupq_n_f32(bias);
+    const float32x4_t s = vdupq_n_f32(scale);
+    for (size_t i = 0; i < len; i += 8) {
+        int16x8_t x = vld1q_s16(&raw[i]);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+        vst1q_f32(&out[i], vmulq_f32(vsubq_f32(lo, b), s));
+        vst1q_f32(&out[i + 4], vmulq_f32(vsubq_f32(hi, b), s));
+    }
+}
+#endif
+
+static void (*imu_calibrate_impl)(const int16_t *raw, float *out, size_t len, float bias, float scale) = imu_calibrate_scalar;
+static const char *imu_calibrate_name = "scalar";
+
+__attribute__((constructor))
+static void imu_calibrate_select(void)
+{
+#ifdef IMU_HAVE_SSE2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        imu_calibrate_impl = imu_calibrate_sse2;
+        imu_calibrate_name = "sse2";
+    }
+#endif
+#ifdef IMU_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        imu_calibrate_impl = imu_calibrate_avx2;
+        imu_calibrate_name = "avx2";
+    }
+#endif
+#ifdef IMU_HAVE_NEON
+    imu_calibrate_impl = imu_calibrate_neon;
+    imu_calibrate_name = "neon";
+#endif
+}
+
+/* Converts all raw samples in the batch, the tail past count is converted too and ignored. */
+static void imu_calibrate(struct imu_batch *batch, const struct imu_calibration *cal)
+{
+    size_t len = (batch->count + 7) & ~(size_t)7;
+    for (int channel = 0; channel < IMU_CHANNELS; ++channel) {
+        imu_calibrate_impl(batch->raw[channel], batch->value[channel], len, cal->bias[channel], cal->scale[channel]);
+    }
+}